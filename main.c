@@ -56,6 +56,9 @@ static void print_help(const char *name)
     { 'f', "force",   "Do not abort on restore error" },
     { 'i', "index",   "Hardlinks index file" },
     { 'm', "mount",   "Do not cross mount point" },
+    { 'a', "atomic",  "Replace files atomically on restore" },
+    { 'g', "group",   "Write links grouped by source in a compact index" },
+    { 's', "sorted",  "Write a sorted and checksummed index" },
     { 0, NULL, NULL }
   };
 
@@ -93,6 +96,9 @@ int main(int argc, char *argv[])
     { "force", no_argument, NULL, 'f' },
     { "index", required_argument, NULL, 'i' },
     { "mount", no_argument, NULL, 'm' },
+    { "atomic", no_argument, NULL, 'a' },
+    { "group", no_argument, NULL, 'g' },
+    { "sorted", no_argument, NULL, 's' },
     { NULL, 0, NULL, 0 }
   };
 
@@ -102,7 +108,7 @@ int main(int argc, char *argv[])
   prog_name = basename(argv[0]);
 
   while(1) {
-    int c = getopt_long(argc, argv, "hVvnFqfi:m", opts, NULL);
+    int c = getopt_long(argc, argv, "hVvnFqfi:mags", opts, NULL);
 
     if(c == -1)
       break;
@@ -132,6 +138,15 @@ int main(int argc, char *argv[])
     case 'r':
       flags |= OPT_REMOVE;
       break;
+    case 'a':
+      flags |= OPT_ATOMIC;
+      break;
+    case 'g':
+      flags |= OPT_GROUP;
+      break;
+    case 's':
+      flags |= OPT_SORTED;
+      break;
     case 'V':
       version();
       exit_status = EXIT_SUCCESS;
@@ -31,6 +31,9 @@ enum opt_flags {
   OPT_REMOVE  = 0x4,  /* remove existing file to replace them with hardlink */
   OPT_VERBOSE = 0x8,  /* be a bit more verbose */
   OPT_DRYRUN  = 0x10, /* perform a trial run with no changes made */
+  OPT_ATOMIC  = 0x20, /* restore through a temporary link and rename */
+  OPT_GROUP   = 0x40, /* write the index grouped by source */
+  OPT_SORTED  = 0x80, /* write a sorted index with a checksum header */
 };
 
 #endif /* _MAIN_H_ */
@@ -22,28 +22,63 @@
    SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#ifdef __linux__
+# define _XOPEN_SOURCE 700
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
 #include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <err.h>
+#include <sys/stat.h>
 
 #ifdef __linux__
 # include <linux/limits.h>
 #endif
 
+#ifndef O_DIRECTORY
+# define O_DIRECTORY 0
+#endif
+
 #include <gawen/string.h>
 #include <gawen/safe-call.h>
 #include <gawen/common.h>
+#include <gawen/htable.h>
 #include <gawen/iobuf.h>
 
+#include "checksum.h"
+#include "restore.h"
 #include "main.h"
 
 #define BUFFER_SIZE (PATH_MAX * 2 + 6) /* "<src>" "<dst>"\n */
 
+#define HT_SIZE 1024
+#define SYNC_BATCH_SIZE 1024 /* directories touched before we sync them */
+#define TEMP_ATTEMPTS 16 /* temporary names tried before giving up */
+
+/* Directories touched by atomic restores. They are kept in a
+   hashtable so each one is only synced once per batch, and in a
+   list so we can walk them when the batch is flushed. */
+struct touched_dir {
+  struct touched_dir *next;
+  char path[];
+};
+
+static struct touched_dir *touched_head;
+static htable_t touched;
+static int touched_count;
+
 /* options */
 static int opt_verbose;
 static int opt_dryrun;
 static int opt_force;
+static int opt_atomic;
 
 static void err_unlink(const char *dst)
 {
@@ -63,6 +98,192 @@ static void err_link(const char *src, const char *dst)
     err(EXIT_FAILURE, ERR_LINK_MSG, src, dst);
 }
 
+static void err_rename(const char *tmp, const char *dst)
+{
+#define ERR_RENAME_MSG "%s -> %s: Cannot rename"
+  if(opt_force)
+    warn(ERR_RENAME_MSG, tmp, dst);
+  else
+    err(EXIT_FAILURE, ERR_RENAME_MSG, tmp, dst);
+}
+
+static void err_sync(const char *dir)
+{
+#define ERR_SYNC_MSG "%s: Cannot sync directory"
+  if(opt_force)
+    warn(ERR_SYNC_MSG, dir);
+  else
+    err(EXIT_FAILURE, ERR_SYNC_MSG, dir);
+}
+
+/* Dan Bernstein's hash */
+static uint32_t djb2_string_hash(const void *key)
+{
+  const unsigned char *s = key;
+  register uint32_t hash = 5381;
+
+  while(*s)
+    hash = ((hash << 5) + hash) + *s++; /* hash * 33 + c */
+
+  return hash;
+}
+
+static bool string_cmp(const void *k1, const void *k2)
+{
+  return !strcmp(k1, k2);
+}
+
+static void init_touched(void)
+{
+  touched = ht_create(HT_SIZE, djb2_string_hash, string_cmp, free);
+  if(!touched)
+    errx(EXIT_FAILURE, "cannot create htable");
+
+  touched_head  = NULL;
+  touched_count = 0;
+}
+
+/* Sync each directory touched since the last flush. One fsync per
+   directory is enough to make all the renames it contains durable. */
+static void sync_touched(int report)
+{
+  struct touched_dir *t;
+
+  for(t = touched_head ; t ; t = t->next) {
+    int fd = open(t->path, O_RDONLY | O_DIRECTORY);
+    if(fd < 0) {
+      if(report)
+        err_sync(t->path);
+      continue;
+    }
+
+    if(fsync(fd) < 0 && report)
+      err_sync(t->path);
+
+    close(fd);
+  }
+}
+
+static void free_touched(void)
+{
+  /* the hashtable owns the entries */
+  ht_destroy(touched);
+  touched_head = NULL;
+}
+
+static void flush_touched(void)
+{
+  sync_touched(1);
+  free_touched();
+  init_touched();
+}
+
+/* Sync what was touched when exiting on error so the renames
+   that already happened remain durable. Errors are ignored here. */
+static void sync_touched_at_exit(void)
+{
+  sync_touched(0);
+}
+
+static void touch_dir(const char *dir)
+{
+  struct touched_dir *t;
+
+  if(ht_search(touched, dir, NULL))
+    return;
+
+  t = xmalloc(sizeof(struct touched_dir) + strlen(dir) + 1);
+  strcpy(t->path, dir);
+  t->next      = touched_head;
+  touched_head = t;
+
+  ht_search(touched, t->path, t);
+
+  if(++touched_count >= SYNC_BATCH_SIZE)
+    flush_touched();
+}
+
+/* Link src to a temporary name next to dst and rename it over dst.
+   Unlike unlink() + link(), dst never goes missing. The directory
+   is recorded so it can be synced at the end of the batch.
+
+   The temporary name is derived from the name of dst so that a
+   temporary left by a crash is found again when the same index is
+   restored. If it already links to src it is simply renamed over
+   dst, which removes it. Other existing entries are never removed. */
+static void restore_file_atomic(const char *src, const char *dst)
+{
+  char dir[PATH_MAX];
+  char tmp[PATH_MAX];
+  const char *base;
+  struct stat st_src, st_dst, st_tmp;
+  int n, attempt, saved_errno, has_src;
+
+  /* already restored, renaming would leave the temporary behind */
+  has_src = !lstat(src, &st_src);
+  if(has_src && !lstat(dst, &st_dst) &&
+     st_src.st_dev == st_dst.st_dev && st_src.st_ino == st_dst.st_ino)
+    return;
+
+  base = strrchr(dst, '/');
+  if(!base) {
+    strcpy(dir, ".");
+    base = dst;
+  }
+  else if(base == dst) {
+    strcpy(dir, "/");
+    base++;
+  }
+  else {
+    if((size_t)(base - dst) >= sizeof(dir)) {
+      errno = ENAMETOOLONG;
+      err_link(src, dst);
+      return;
+    }
+
+    memcpy(dir, dst, base - dst);
+    dir[base - dst] = '\0';
+    base++;
+  }
+
+  for(attempt = 0 ; attempt < TEMP_ATTEMPTS ; attempt++) {
+    n = snprintf(tmp, sizeof(tmp), "%s/" TEMP_PREFIX "%08" PRIx32 ".%d",
+                 dir, djb2_string_hash(base), attempt);
+    if(n < 0 || (size_t)n >= sizeof(tmp)) {
+      errno = ENAMETOOLONG;
+      n = -1;
+      break;
+    }
+
+    n = linkat(AT_FDCWD, src, AT_FDCWD, tmp, 0);
+    if(n == 0 || errno != EEXIST)
+      break;
+
+    /* stale temporary of this inode, reuse it */
+    if(has_src && !lstat(tmp, &st_tmp) &&
+       st_src.st_dev == st_tmp.st_dev && st_src.st_ino == st_tmp.st_ino) {
+      n = 0;
+      break;
+    }
+  }
+  if(n < 0) {
+    err_link(src, dst);
+    return;
+  }
+
+  n = renameat(AT_FDCWD, tmp, AT_FDCWD, dst);
+  if(n < 0) {
+    saved_errno = errno;
+    unlink(tmp);
+    errno = saved_errno;
+
+    err_rename(tmp, dst);
+    return;
+  }
+
+  touch_dir(dir);
+}
+
 static void restore_file(const char *path, const char *src, const char *dst)
 {
   UNUSED(path);
@@ -70,7 +291,12 @@ static void restore_file(const char *path, const char *src, const char *dst)
   if(opt_verbose)
     fprintf(stderr, "%s -> %s\n", src, dst);
 
-  if(!opt_dryrun) {
+  if(opt_dryrun)
+    return;
+
+  if(opt_atomic)
+    restore_file_atomic(src, dst);
+  else {
     int n = unlink(dst);
     if(n < 0)
       err_unlink(dst);
@@ -81,14 +307,137 @@ static void restore_file(const char *path, const char *src, const char *dst)
   }
 }
 
-int restore(const char *index_file, const char *path, int flags)
+/* Decode a path stored as the number of bytes it shares with
+   the previous path followed by the escaped remainder. The escaped
+   length bounds the decoded one so we check it against the buffer. */
+static const char * read_delta(char *prev, const char *s)
+{
+  unsigned long shared;
+  char *end;
+
+  /* strtoul() would also accept blanks and a sign */
+  if(!isdigit((unsigned char)*s))
+    return NULL;
+
+  shared = strtoul(s, &end, 10);
+  if(end == s || *end != ' ' || shared > strlen(prev))
+    return NULL;
+
+  if(shared + strlen(end + 1) >= BUFFER_SIZE)
+    return NULL;
+
+  return strunesc(prev + shared, end + 1);
+}
+
+/* The checksum is exactly 16 hexadecimal digits. */
+static int read_checksum(const char *s, uint64_t *checksum)
+{
+  int i;
+
+  for(i = 0 ; i < 16 ; i++) {
+    if(!isxdigit((unsigned char)s[i]))
+      return -1;
+  }
+
+  if(s[16] != '\0')
+    return -1;
+
+  *checksum = strtoull(s, NULL, 16);
+  return 0;
+}
+
+/* Read the index and restore its links, or only check it.
+   Return non-zero when the index does not match its checksum. */
+static int read_index(iofile_t in, const char *path, int check_only)
 {
   char read_buf[BUFFER_SIZE];
   char src_buf[BUFFER_SIZE];
-  char dst_buf[BUFFER_SIZE];
+  char dst_buf[BUFFER_SIZE] = "";
   const char *s;
-  iofile_t in;
   ssize_t  n;
+  int group = 0;
+  int has_checksum = 0;
+  unsigned long line = 0;
+  uint64_t checksum = 0;
+  uint64_t hash = CHECKSUM_INIT;
+
+  while((n = iobuf_gets(in, read_buf, BUFFER_SIZE))) {
+    if(n < 0)
+      err(EXIT_FAILURE, "read error");
+
+    strip_gets_newline(read_buf, n);
+    line++;
+
+    /* nothing to check without a checksum */
+    if(check_only && !has_checksum && *read_buf != '#')
+      return 0;
+
+    switch(*read_buf) {
+    case '#':
+      /* checksum on top of a sorted index */
+      if(line != 1 || strncmp(read_buf, CHECKSUM_HEADER, sizeof(CHECKSUM_HEADER) - 1))
+        errx(EXIT_FAILURE, "'%s': Invalid line", read_buf);
+
+      if(read_checksum(read_buf + sizeof(CHECKSUM_HEADER) - 1, &checksum))
+        errx(EXIT_FAILURE, "'%s': Invalid checksum", read_buf);
+
+      has_checksum = 1;
+      continue;
+    case '"':
+      /* link in the format: "<src>" "<dst>" */
+      s = strunesc(src_buf, read_buf);
+      if(!s)
+        errx(EXIT_FAILURE, "'%s': Invalid line", read_buf);
+
+      if(*s++ != ' ')
+        errx(EXIT_FAILURE, "'%s': Invalid line", read_buf);
+
+      s = strunesc(dst_buf, s);
+      group = 0;
+      break;
+    case '\t':
+      /* link of the current group: \t<shared> "<dst>" */
+      if(!group)
+        errx(EXIT_FAILURE, "'%s': Link outside of a group", read_buf);
+
+      s = read_delta(dst_buf, read_buf + 1);
+      break;
+    default:
+      /* start of a group: <shared> "<src>"
+         the source is decoded once for all its links */
+      s = read_delta(dst_buf, read_buf);
+      if(!s)
+        errx(EXIT_FAILURE, "'%s': Invalid line", read_buf);
+
+      if(*s != '\0')
+        warnx("'%s': Garbage after line", read_buf);
+
+      strcpy(src_buf, dst_buf);
+      group = 1;
+      continue;
+    }
+
+    if(!s)
+      errx(EXIT_FAILURE, "'%s': Invalid line", read_buf);
+
+    if(*s != '\0')
+      warnx("'%s': Garbage after line", read_buf);
+
+    if(has_checksum)
+      hash = checksum_link(hash, src_buf, dst_buf);
+
+    if(!check_only)
+      restore_file(path, src_buf, dst_buf);
+  }
+
+  return has_checksum && hash != checksum;
+}
+
+int restore(const char *index_file, const char *path, int flags)
+{
+  struct stat st;
+  iofile_t in;
+  int status = EXIT_SUCCESS;
 
   if(flags & OPT_VERBOSE)
     opt_verbose = 1;
@@ -96,6 +445,21 @@ int restore(const char *index_file, const char *path, int flags)
     opt_dryrun = 1;
   if(flags & OPT_FORCE)
     opt_force = 1;
+  if(flags & OPT_ATOMIC)
+    opt_atomic = 1;
+
+  /* A regular file can be read twice,
+     so check it before changing anything. */
+  if(index_file && !stat(index_file, &st) && S_ISREG(st.st_mode)) {
+    in = iobuf_open(index_file, O_RDONLY, 0);
+    if(!in)
+      errx(EXIT_FAILURE, "cannot open index");
+
+    if(read_index(in, path, 1))
+      errx(EXIT_FAILURE, "%s: Index checksum mismatch, nothing restored", index_file);
+
+    iobuf_close(in);
+  }
 
   /* re-open buffered stdin */
   if(!index_file)
@@ -105,31 +469,24 @@ int restore(const char *index_file, const char *path, int flags)
   if(!in)
     errx(EXIT_FAILURE, "cannot re-open stdin");
 
-  while((n = iobuf_gets(in, read_buf, BUFFER_SIZE))) {
-    if(n < 0)
-      err(EXIT_FAILURE, "read error");
-
-    strip_gets_newline(read_buf, n);
-
-    /* all link are in the format: "<src>" "<dst>" */
-    s = strunesc(src_buf, read_buf);
-    if(!s)
-      errx(EXIT_FAILURE, "'%s': Invalid line", read_buf);
-
-    if(*s++ != ' ')
-      errx(EXIT_FAILURE, "'%s': Invalid line", read_buf);
-
-    s = strunesc(dst_buf, s);
-    if(!s)
-      errx(EXIT_FAILURE, "'%s': Invalid line", read_buf);
-
-    if(*s != '\0')
-      warnx("'%s': Garbage after line", read_buf);
+  if(opt_atomic) {
+    init_touched();
+    atexit(sync_touched_at_exit);
+  }
 
-    restore_file(path, src_buf, dst_buf);
+  /* Other inputs cannot be checked beforehand. The checksum
+     then only tells that the index is not the one scanned. */
+  if(read_index(in, path, 0)) {
+    warnx("Index checksum mismatch, links already restored");
+    status = EXIT_FAILURE;
   }
 
   iobuf_close(in);
 
-  return 0;
+  if(opt_atomic) {
+    sync_touched(1);
+    free_touched();
+  }
+
+  return status;
 }
@@ -25,6 +25,10 @@
 #ifndef _RESTORE_H_
 #define _RESTORE_H_
 
+/* Prefix of the temporary links created by atomic restores.
+   They are ignored when scanning. */
+#define TEMP_PREFIX ".hardlinks."
+
 int restore(const char *index_file, const char *path, int flags);
 
 #endif /* _RESTORE_H_ */
@@ -26,8 +26,10 @@
 # define _XOPEN_SOURCE 500
 #endif
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <string.h>
 #include <ftw.h>
 #include <err.h>
@@ -39,6 +41,9 @@
 #include <gawen/common.h>
 #include <gawen/iobuf.h>
 
+#include "checksum.h"
+#include "sort.h"
+#include "restore.h"
 #include "main.h"
 #include "scan.h"
 
@@ -60,6 +65,25 @@ struct key_alloc_block {
 static struct key_alloc_block *alloc_head;
 static int alloc_idx;
 
+/* In group and sorted modes the links are kept with their source.
+   A group is flushed as soon as all the links of its inode have
+   been seen, the others when the scan is done. */
+struct link {
+  struct link *next;
+  char path[];
+};
+
+struct source {
+  struct source *next;  /* next source in encounter order */
+  struct link   *links;
+  struct link  **tail;
+  nlink_t nb_paths;     /* paths of the inode seen so far */
+  char path[];
+};
+
+static struct source *sources_head;
+static struct source **sources_tail = &sources_head;
+
 /* hardlinks hashtable with inode
    as key and original path as data. */
 static htable_t hardlinks;
@@ -67,8 +91,16 @@ static htable_t hardlinks;
 /* buffered stdout */
 static iofile_t out;
 
+/* last path written in group mode */
+static char prev_path[PATH_MAX + 1];
+
+/* checksum of a sorted index */
+static uint64_t sorted_hash;
+
 /* options */
 static int opt_quiet;
+static int opt_group;
+static int opt_sorted;
 
 /* Dan Bernstein's hash */
 uint32_t djb2_hardlink_hash(const void *key)
@@ -128,14 +160,212 @@ static void free_keys(void)
   }
 }
 
-static int scan_file(const char *path, const struct stat *stat, int flag, struct FTW *ftw)
+static struct source * create_source(const char *path)
+{
+  struct source *source = xmalloc(sizeof(struct source) + strlen(path) + 1);
+
+  strcpy(source->path, path);
+  source->next  = NULL;
+  source->links = NULL;
+  source->tail  = &source->links;
+  source->nb_paths = 1;
+
+  *sources_tail = source;
+  sources_tail  = &source->next;
+
+  return source;
+}
+
+static void append_link(struct source *source, const char *path)
+{
+  struct link *link = xmalloc(sizeof(struct link) + strlen(path) + 1);
+
+  strcpy(link->path, path);
+  source->nb_paths++;
+
+  link->next    = NULL;
+  *source->tail = link;
+  source->tail  = &link->next;
+}
+
+static void free_links(struct source *source)
+{
+  struct link *link;
+
+  while(source->links) {
+    link          = source->links;
+    source->links = link->next;
+    free(link);
+  }
+
+  source->tail = &source->links;
+}
+
+static void free_source(void *data)
+{
+  free_links(data);
+  free(data);
+}
+
+static void write_pair(const char *src, const char *dst)
 {
   static char escaped_buffer[PATH_MAX * 2 + 3]; /* escaping + "" + \0 */
-  const char *source_path;
-  const struct hardlink *devino;
   int n;
 
-  UNUSED(ftw);
+  n = stresc(escaped_buffer, src);
+  iobuf_write(out, escaped_buffer, n);
+  iobuf_putc(' ', out);
+
+  n = stresc(escaped_buffer, dst);
+  iobuf_write(out, escaped_buffer, n);
+  iobuf_putc('\n', out);
+}
+
+/* Write a path as the number of bytes shared with the previous
+   path followed by the escaped remainder. The shared prefix always
+   ends on a '/' so that each line remains a readable relative path. */
+static void write_delta(const char *path)
+{
+  static char escaped_buffer[PATH_MAX * 2 + 3]; /* escaping + "" + \0 */
+  char len_buffer[16];
+  size_t i, shared = 0;
+  int n;
+
+  for(i = 0 ; path[i] && path[i] == prev_path[i] ; i++) {
+    if(path[i] == '/')
+      shared = i + 1;
+  }
+
+  n = sprintf(len_buffer, "%u", (unsigned int)shared);
+  iobuf_write(out, len_buffer, n);
+  iobuf_putc(' ', out);
+
+  n = stresc(escaped_buffer, path + shared);
+  iobuf_write(out, escaped_buffer, n);
+  iobuf_putc('\n', out);
+
+  strcpy(prev_path + shared, path + shared);
+}
+
+/* Group format, a source line followed by one indented line per link:
+     <shared> "<source>"
+     \t<shared> "<link>" */
+static void write_source(const struct source *source)
+{
+  const struct link *link;
+
+  write_delta(source->path);
+
+  for(link = source->links ; link ; link = link->next) {
+    iobuf_putc('\t', out);
+    write_delta(link->path);
+  }
+}
+
+static void write_header(uint64_t hash)
+{
+  char header[sizeof(CHECKSUM_HEADER) + 17]; /* 16 digits + \n */
+  int n;
+
+  n = sprintf(header, CHECKSUM_HEADER "%016" PRIx64 "\n", hash);
+  iobuf_write(out, header, n);
+}
+
+static int path_cmp(const void *p1, const void *p2)
+{
+  return strcmp(*(const char * const *)p1, *(const char * const *)p2);
+}
+
+/* The paths of a group are sorted so the source does not depend on
+   the traversal order. In group mode the group is one record sorted on
+   its source, otherwise each link is a record sorted on its destination. */
+static void sort_source(const struct source *source)
+{
+  const struct link *link;
+  const char **paths, *pair[2];
+  size_t i, nb_paths = 1;
+
+  for(link = source->links ; link ; link = link->next)
+    nb_paths++;
+
+  paths = xmalloc(nb_paths * sizeof(const char *));
+
+  paths[0] = source->path;
+  for(i = 1, link = source->links ; link ; i++, link = link->next)
+    paths[i] = link->path;
+
+  qsort(paths, nb_paths, sizeof(const char *), path_cmp);
+
+  if(opt_group)
+    sort_push(paths, nb_paths);
+  else {
+    pair[0] = paths[0];
+    for(i = 1 ; i < nb_paths ; i++) {
+      pair[1] = paths[i];
+      sort_push(pair, 2);
+    }
+  }
+
+  free(paths);
+}
+
+static void flush_source(struct source *source)
+{
+  if(opt_sorted)
+    sort_source(source);
+  else
+    write_source(source);
+
+  free_links(source);
+}
+
+/* Records hold the source followed by its links. */
+static void hash_record(const char *paths, size_t nb_paths)
+{
+  const char *src = paths;
+  size_t i;
+
+  for(i = 1 ; i < nb_paths ; i++) {
+    paths += strlen(paths) + 1;
+    sorted_hash = checksum_link(sorted_hash, src, paths);
+  }
+}
+
+static void write_record(const char *paths, size_t nb_paths)
+{
+  const char *src = paths;
+  size_t i;
+
+  if(opt_group)
+    write_delta(src);
+
+  for(i = 1 ; i < nb_paths ; i++) {
+    paths += strlen(paths) + 1;
+
+    if(opt_group) {
+      iobuf_putc('\t', out);
+      write_delta(paths);
+    }
+    else
+      write_pair(src, paths);
+  }
+}
+
+/* The header needs the checksum of the whole
+   index so the records are walked twice. */
+static void write_sorted(void)
+{
+  sorted_hash = CHECKSUM_INIT;
+  sort_walk(hash_record);
+
+  write_header(sorted_hash);
+  sort_walk(write_record);
+}
+
+static int scan_file(const char *path, const struct stat *stat, int flag, struct FTW *ftw)
+{
+  struct source *source;
+  const struct hardlink *devino;
 
   if(strlen(path) > PATH_MAX)
     errx(EXIT_FAILURE, "%s: Path too long", path);
@@ -160,44 +390,48 @@ static int scan_file(const char *path, const struct stat *stat, int flag, struct
   if(stat->st_nlink < 2)
     return 0;
 
+  /* temporary left by an interrupted atomic restore */
+  if(!strncmp(path + ftw->base, TEMP_PREFIX, sizeof(TEMP_PREFIX) - 1))
+    return 0;
+
   /* create hardlink key */
   devino = create_temporary_key(stat);
 
   /* first encounter -> save
      otherwise display link */
-  source_path = ht_search(hardlinks, devino, NULL);
-  if(!source_path) {
-    ht_search(hardlinks, devino, strdup(path));
+  source = ht_search(hardlinks, devino, NULL);
+  if(!source) {
+    ht_search(hardlinks, devino, create_source(path));
     commit_key();
   }
-  else {
-    n = stresc(escaped_buffer, source_path);
-    iobuf_write(out, escaped_buffer, n);
-    iobuf_putc(' ', out);
+  else if(opt_group || opt_sorted) {
+    append_link(source, path);
 
-    n = stresc(escaped_buffer, path);
-    iobuf_write(out, escaped_buffer, n);
-    iobuf_putc('\n', out);
+    /* all the links of the inode are known, the group is complete */
+    if(source->nb_paths == stat->st_nlink)
+      flush_source(source);
   }
+  else
+    write_pair(source->path, path);
 
   return 0;
 }
 
 int scan(const char *index_file, const char *path, int ftw_flags, int flags)
 {
+  struct source *source;
   int n;
 
   /* configure options */
   if(!path)
     path = ".";
 
-  switch(flags) {
-  case OPT_QUIET:
+  if(flags & OPT_QUIET)
     opt_quiet = 1;
-    break;
-  default:
-    break;
-  }
+  if(flags & OPT_GROUP)
+    opt_group = 1;
+  if(flags & OPT_SORTED)
+    opt_sorted = 1;
 
   /* re-open buffered stdout */
   if(!index_file)
@@ -210,10 +444,14 @@ int scan(const char *index_file, const char *path, int ftw_flags, int flags)
   /* init keys allocator */
   init_keys();
 
+  /* pairs are sorted on their destination, groups on their source */
+  if(opt_sorted)
+    sort_init(opt_group ? 0 : 1);
+
   hardlinks = ht_create(HT_SIZE,
                         djb2_hardlink_hash,
                         hardlink_cmp,
-                        free);
+                        free_source);
   if(!hardlinks)
     errx(EXIT_FAILURE, "cannot create htable");
 
@@ -221,6 +459,18 @@ int scan(const char *index_file, const char *path, int ftw_flags, int flags)
   if(n)
     err(EXIT_FAILURE, "cannot traverse directory");
 
+  if(opt_group || opt_sorted) {
+    for(source = sources_head ; source ; source = source->next) {
+      if(source->links)
+        flush_source(source);
+    }
+  }
+
+  if(opt_sorted) {
+    write_sorted();
+    sort_destroy();
+  }
+
   iobuf_close(out);
   ht_destroy(hardlinks);
   free_keys();
@@ -0,0 +1,257 @@
+/* Copyright (c) 2018, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+
+#ifdef __linux__
+# include <linux/limits.h>
+#endif
+
+#include <gawen/safe-call.h>
+
+#include "sort.h"
+
+#define RUN_SIZE    (32 * 1024 * 1024) /* bytes of paths buffered in memory */
+#define RUN_RECORDS (256 * 1024)       /* records buffered in memory */
+
+struct record {
+  const char *key;
+  size_t nb_paths;
+  size_t size;    /* size of the packed paths */
+  char paths[];
+};
+
+/* sorted records spilled to a temporary file */
+struct run {
+  struct run *next;
+  FILE *file;
+  struct record *head; /* current record while merging */
+};
+
+static struct record **buffer;
+static size_t nb_buffered;
+static size_t buffered_size;
+static int buffer_sorted;
+
+static struct run *runs;
+static size_t key_index;
+
+static const char * record_key(const struct record *record)
+{
+  const char *key = record->paths;
+  size_t i;
+
+  for(i = 0 ; i < key_index ; i++)
+    key += strlen(key) + 1;
+
+  return key;
+}
+
+static int record_cmp(const void *r1, const void *r2)
+{
+  return strcmp((*(const struct record * const *)r1)->key,
+                (*(const struct record * const *)r2)->key);
+}
+
+static void sort_buffer(void)
+{
+  if(!buffer_sorted)
+    qsort(buffer, nb_buffered, sizeof(struct record *), record_cmp);
+  buffer_sorted = 1;
+}
+
+/* Records are written as their packed paths followed by an empty path. */
+static void spill_run(void)
+{
+  struct run *run = xmalloc(sizeof(struct run));
+  size_t i;
+
+  run->file = tmpfile();
+  if(!run->file)
+    err(EXIT_FAILURE, "cannot create temporary run");
+
+  sort_buffer();
+
+  for(i = 0 ; i < nb_buffered ; i++) {
+    fwrite(buffer[i]->paths, buffer[i]->size, 1, run->file);
+    putc('\0', run->file);
+    free(buffer[i]);
+  }
+
+  if(fflush(run->file) || ferror(run->file))
+    err(EXIT_FAILURE, "cannot write temporary run");
+
+  run->head = NULL;
+  run->next = runs;
+  runs      = run;
+
+  nb_buffered   = 0;
+  buffered_size = 0;
+  buffer_sorted = 0;
+}
+
+static struct record * read_record(FILE *file)
+{
+  struct record *record;
+  size_t size = 0, nb_paths = 0, start = 0;
+  size_t alloc = PATH_MAX;
+  int c;
+
+  record = xmalloc(sizeof(struct record) + alloc);
+
+  while((c = getc(file)) != EOF) {
+    if(size == alloc) {
+      alloc *= 2;
+      record = realloc(record, sizeof(struct record) + alloc);
+      if(!record)
+        err(EXIT_FAILURE, "cannot read temporary run");
+    }
+
+    /* an empty path ends the record */
+    if(!c && size == start)
+      break;
+
+    record->paths[size++] = c;
+    if(!c) {
+      nb_paths++;
+      start = size;
+    }
+  }
+
+  if(ferror(file))
+    err(EXIT_FAILURE, "cannot read temporary run");
+
+  if(!nb_paths) {
+    free(record);
+    return NULL;
+  }
+
+  record->nb_paths = nb_paths;
+  record->size     = size;
+  record->key      = record_key(record);
+
+  return record;
+}
+
+/* The number of runs is small, a linear
+   scan is enough to find the next record. */
+static void merge_runs(void (*action)(const char *paths, size_t nb_paths))
+{
+  struct run *run, *min;
+
+  for(run = runs ; run ; run = run->next) {
+    rewind(run->file);
+    run->head = read_record(run->file);
+  }
+
+  while(1) {
+    min = NULL;
+    for(run = runs ; run ; run = run->next) {
+      if(run->head && (!min || strcmp(run->head->key, min->head->key) < 0))
+        min = run;
+    }
+
+    if(!min)
+      break;
+
+    action(min->head->paths, min->head->nb_paths);
+
+    free(min->head);
+    min->head = read_record(min->file);
+  }
+}
+
+void sort_init(size_t key)
+{
+  key_index = key;
+  buffer    = xmalloc(RUN_RECORDS * sizeof(struct record *));
+}
+
+void sort_push(const char * const *paths, size_t nb_paths)
+{
+  struct record *record;
+  size_t i, n, size = 0;
+  char *p;
+
+  for(i = 0 ; i < nb_paths ; i++)
+    size += strlen(paths[i]) + 1;
+
+  if(nb_buffered && (nb_buffered == RUN_RECORDS ||
+                     buffered_size + size > RUN_SIZE))
+    spill_run();
+
+  record = xmalloc(sizeof(struct record) + size);
+  record->nb_paths = nb_paths;
+  record->size     = size;
+
+  p = record->paths;
+  for(i = 0 ; i < nb_paths ; i++) {
+    n = strlen(paths[i]) + 1;
+    memcpy(p, paths[i], n);
+    p += n;
+  }
+  record->key = record_key(record);
+
+  buffer[nb_buffered++] = record;
+  buffered_size        += size;
+  buffer_sorted         = 0;
+}
+
+void sort_walk(void (*action)(const char *paths, size_t nb_paths))
+{
+  size_t i;
+
+  /* everything fits in memory */
+  if(!runs) {
+    sort_buffer();
+    for(i = 0 ; i < nb_buffered ; i++)
+      action(buffer[i]->paths, buffer[i]->nb_paths);
+    return;
+  }
+
+  if(nb_buffered)
+    spill_run();
+
+  merge_runs(action);
+}
+
+void sort_destroy(void)
+{
+  struct run *run;
+  size_t i;
+
+  for(i = 0 ; i < nb_buffered ; i++)
+    free(buffer[i]);
+  free(buffer);
+
+  while(runs) {
+    run  = runs;
+    runs = runs->next;
+    fclose(run->file);
+    free(run);
+  }
+}